@@ -27,16 +27,24 @@
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL_ttf.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <time.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 typedef uint8_t u8;
+typedef int16_t i16;
 typedef int32_t i32;
 typedef uint32_t u32;
+typedef uint64_t u64;
 typedef int32_t b32;
 typedef float f32;
+typedef double f64;
 typedef char byte;
 
 #define SCREEN_WIDTH     800
@@ -46,6 +54,12 @@ typedef char byte;
 #define JUMP_VELOCITY    15
 #define GRAVITY          1
 #define TERMINAL_SPEED   15
+#define MAX_RUN_FRAMES   (60 * 60 * 10) // ten minutes of flapping
+#define GHOST_MAGIC      0x54534847     // "GHST"
+#define GHOST_ALPHA      80
+#define GHOST_PREFETCH   512            // frames between read-ahead requests for each mapped trace
+#define GHOST_LEAD       64             // frames a read-ahead request is issued before the heights are drawn
+#define GHOST_SESSION    256            // runs flown this session that can join the race
 
 enum sprite_type { SPRITE_SKY = 0, SPRITE_BIRD, SPRITE_PIPE, SPRITE_PLAY, SPRITE_RESTART, SPRITE_GAMEOVER, SPRITE_COUNT };
 static struct {
@@ -57,9 +71,10 @@ static struct {
     SDL_Window *window;
     SDL_Renderer *renderer;
     TTF_Font* font;
-    b32 keyboard[SDL_NUM_SCANCODES];
-    i32 mouse_x, mouse_y;
-    b32 mouse_down, mouse_clicked;
+    _Atomic b32 keyboard[SDL_NUM_SCANCODES];
+    _Atomic i32 mouse_x, mouse_y;
+    b32 mouse_down;
+    _Atomic b32 mouse_clicked; // set by the event loop, consumed by the simulation
     enum { GAME_STATE_MENU, GAME_STATE_PLAYING, GAME_STATE_GAME_OVER } state;
     i32 score;
     FILE *savefile;
@@ -72,6 +87,8 @@ static struct {
     i32 current;
     i32 to_pass;
     b32 visible[5];
+    u32 seed;    // course seed, pipe heights are a pure function of it
+    u32 spawned; // pipes spawned so far in this run
 } spawner = {0};
 
 static struct {
@@ -90,6 +107,77 @@ static struct {
     SDL_Rect r2;
 } background;
 
+/* bird height after every simulation step of the current run */
+static struct {
+    i16 trace[MAX_RUN_FRAMES];
+    u32 frames;
+} recorder;
+
+/*
+ * Each course has two files: ghosts/<seed> holds the runs' bird heights as
+ * i16, back to back, and ghosts/<seed>.idx one ghost_entry per run. Loading
+ * reads only the index; the traces are memory mapped and never copied,
+ * every frame reads the one height per ghost it is about to draw, and
+ * prefetch_ghosts keeps the kernel reading just ahead of that. Runs flown
+ * this session are copied into `runs` after the mapped ones, the renderer
+ * sees them through the ghost count in its snapshot, so `runs` never moves
+ * once loaded.
+ */
+typedef struct {
+    u32 magic;
+    u32 frames;
+    u64 offset; // of the first height in ghosts/<seed>
+} ghost_entry;
+
+static const char *ghost_dir = "ghosts";
+
+static struct {
+    u8 *map;
+    size_t size;
+    size_t page;
+    struct { const i16 *trace; u32 frames; } *runs;
+    i32 count, loaded, capacity; // loaded: runs backed by the mapping, the rest are heap copies
+    SDL_Vertex *vertices; // 4 per ghost, refilled every frame
+    i32 *indices;         // 6 per ghost, two triangles per quad
+} ghosts = {0};
+
+/* state handed from the simulation to the renderer */
+typedef struct {
+    i32 state;
+    SDL_Rect sky[2];
+    SDL_Rect bird;
+    f32 bird_velocity;
+    SDL_Rect pipe_top[5], pipe_bottom[5];
+    b32 pipe_visible[5];
+    i32 score, highscore;
+    u32 frame; // frames into the current run, indexes the ghost traces
+    i32 ghost_count;
+} snapshot;
+
+static struct {
+    b32 threaded;       // -t: simulate on its own thread
+    b32 print_rates;    // -p: print simulation and render rates every second
+    u32 sim_load;       // -s MS: artificial delay added to every simulation step
+    u32 render_load;    // -r MS: artificial delay added to every rendered frame
+    b32 fixed_course;   // -c SEED: play course SEED instead of a random one
+    u32 course_seed;
+} options = {0};
+
+/*
+ * Triple buffer between the simulation thread (producer) and the render
+ * thread (consumer). Each side owns one slot, the third one is parked in
+ * `middle` with TB_FRESH set when it holds an unread snapshot. Both publish
+ * and acquire are a single atomic exchange, so neither side ever blocks.
+ */
+#define TB_FRESH 4
+static struct {
+    snapshot slots[3];
+    _Atomic i32 middle;
+    i32 back, front;
+} tb = { .middle = 1, .back = 0, .front = 2 };
+static atomic_int running = 1;
+static atomic_int sim_steps = 0;
+
 SDL_Rect button_box = {SCREEN_WIDTH / 2 - 50, SCREEN_HEIGHT * 2 / 3 - 50, 100, 100}; 
 SDL_Rect gameover_box = {SCREEN_WIDTH / 2 - 300, SCREEN_HEIGHT / 2 - 222, 600, 444}; 
 
@@ -144,6 +232,8 @@ static void reset(void)
     spawner.gap = 3 * sprites[SPRITE_BIRD].width;
     spawner.distance = 300.0;
     spawner.current = spawner.to_pass = 0;
+    spawner.spawned = 0;
+    recorder.frames = 0;
     for (i32 i = 0;  i < 5; ++i) { spawner.visible[i] = 0; }
     spawner.visible[0] = 1;
     set_pipe(0, SCREEN_WIDTH, SCREEN_HEIGHT / 2.0);
@@ -218,17 +308,17 @@ static void draw_sprite(i32 sprite, SDL_Rect rect, f32 angle, i32 flip)
     SDL_RenderCopyEx(game.renderer, sprites[sprite].texture, 0, &rect, angle, 0, flip);
 }
 
-static void draw_pipes(void) 
+static void draw_pipes(const snapshot *s) 
 {
     for (i32 i = 0; i < 5; ++i) {
-        if (spawner.visible[i]) {
-            draw_sprite(SPRITE_PIPE, pipes[i].top, 0, SDL_FLIP_VERTICAL);
-            draw_sprite(SPRITE_PIPE, pipes[i].bottom, 0, 0);
+        if (s->pipe_visible[i]) {
+            draw_sprite(SPRITE_PIPE, s->pipe_top[i], 0, SDL_FLIP_VERTICAL);
+            draw_sprite(SPRITE_PIPE, s->pipe_bottom[i], 0, 0);
         }
     }
 }
 
-static void do_background(void)
+static void scroll_background(void)
 {
     background.r1.x -= BACKGROUND_SPEED;
     background.r2.x -= BACKGROUND_SPEED;
@@ -240,9 +330,6 @@ static void do_background(void)
     if (background.r2.x + background.r2.w <= 0) {
         background.r2.x = background.r1.x + background.r1.w;
     }
-
-    draw_sprite(SPRITE_SKY, background.r1, 0, 0);
-    draw_sprite(SPRITE_SKY, background.r2, 0, 0);
 }
 
 static void draw_text(const char *text, i32 pos_x, i32 pos_y, f32 scale) 
@@ -255,6 +342,28 @@ static void draw_text(const char *text, i32 pos_x, i32 pos_y, f32 scale)
     SDL_DestroyTexture(msg);
 }
 
+static u32 course_rand(u32 seed, u32 n) // stateless hash, so any pipe of a course can be regenerated
+{
+    u32 x = seed ^ (n * 0x9e3779b9u);
+    x ^= x >> 16; x *= 0x7feb352du;
+    x ^= x >> 15; x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static void integrate_bird(b32 space)
+{
+    if (space && !bird.jumped) {
+        bird.velocity = -JUMP_VELOCITY;
+        bird.jumped = 1;
+    } else if (!space) {
+        bird.jumped = 0;
+    }
+
+    bird.velocity = fmin(bird.velocity + GRAVITY, TERMINAL_SPEED);
+    bird.aabb.y += bird.velocity;
+}
+
 static void update_playing()
 {
     for (i32 i = 0; i < 5; ++i) {
@@ -269,19 +378,11 @@ static void update_playing()
         spawner.current = (spawner.current + 1) % 5;
         spawner.visible[spawner.current] = 1;
         f32 pos_x = SCREEN_WIDTH + sprites[SPRITE_PIPE].width;
-        f32 pos_y = fmin(SCREEN_HEIGHT - 200, fmax(200, rand() % SCREEN_HEIGHT));
+        f32 pos_y = fmin(SCREEN_HEIGHT - 200, fmax(200, course_rand(spawner.seed, ++spawner.spawned) % SCREEN_HEIGHT));
         set_pipe(spawner.current, pos_x, pos_y);
     }
 
-    if (game.keyboard[SDL_SCANCODE_SPACE] && !bird.jumped) {
-        bird.velocity = -JUMP_VELOCITY;
-        bird.jumped = 1;
-    } else if (!game.keyboard[SDL_SCANCODE_SPACE]) {
-        bird.jumped = 0;
-    }
-
-    bird.velocity = fmin(bird.velocity + GRAVITY, TERMINAL_SPEED);
-    bird.aabb.y += bird.velocity;
+    integrate_bird(game.keyboard[SDL_SCANCODE_SPACE]);
 
     if (bird.aabb.x + bird.aabb.w > pipes[spawner.to_pass].top.x + sprites[SPRITE_PIPE].width) {
         spawner.to_pass = (spawner.to_pass + 1) % 5;
@@ -304,27 +405,611 @@ static void update_playing()
     }
 }
 
-static void update_menu(void)
+static void update_menu(b32 clicked)
 {
-    if (game.keyboard[SDL_SCANCODE_SPACE] || (game.mouse_clicked && AABBcollide((SDL_Rect){game.mouse_x, game.mouse_y, 1, 1}, button_box))) {
+    if (game.keyboard[SDL_SCANCODE_SPACE] || (clicked && AABBcollide((SDL_Rect){game.mouse_x, game.mouse_y, 1, 1}, button_box))) {
         reset();
         game.state = GAME_STATE_PLAYING;
     }
 }
 
-int main(void)
+static void ghost_path(char *path, size_t size, u32 seed, const char *suffix)
+{
+    snprintf(path, size, "%s/%u%s", ghost_dir, seed, suffix);
+}
+
+// heights first, then the index entry, so the index never points past the end of the traces
+static void append_run(u32 seed, const i16 *trace, u32 frames)
+{
+    char path[256];
+    mkdir(ghost_dir, 0755);
+    ghost_path(path, sizeof(path), seed, "");
+    FILE *f = fopen(path, "ab");
+    if (!f) return;
+    fseek(f, 0, SEEK_END);
+    ghost_entry e = { GHOST_MAGIC, frames, ftell(f) };
+    b32 written = fwrite(trace, sizeof(i16), frames, f) == frames;
+    if (fclose(f) || !written) return;
+    ghost_path(path, sizeof(path), seed, ".idx");
+    if (!(f = fopen(path, "ab"))) return;
+    fwrite(&e, sizeof(e), 1, f);
+    fclose(f);
+}
+
+// asks the kernel to start reading heights [from, to) of a mapped trace, without waiting for them
+static void prefetch_trace(i32 i, u32 from, u32 to)
+{
+    if (to > ghosts.runs[i].frames) to = ghosts.runs[i].frames;
+    if (from >= to) return;
+    uintptr_t start = (uintptr_t)(ghosts.runs[i].trace + from) & ~(ghosts.page - 1);
+    madvise((void *)start, (uintptr_t)(ghosts.runs[i].trace + to) - start, MADV_WILLNEED);
+}
+
+/*
+ * Ghost i gets its read-ahead refreshed on the frames where frame % GHOST_PREFETCH
+ * == i % GHOST_PREFETCH, so only a handful of ghosts are handled per frame. Each
+ * request reaches GHOST_LEAD frames past the next one.
+ */
+static void prefetch_ghosts(u32 frame)
+{
+    for (i32 i = frame % GHOST_PREFETCH; i < ghosts.loaded; i += GHOST_PREFETCH)
+        prefetch_trace(i, frame, frame + GHOST_PREFETCH + GHOST_LEAD);
+}
+
+static void save_run(void)
+{
+    printf("course %u: score %d\n", spawner.seed, game.score);
+    append_run(spawner.seed, recorder.trace, recorder.frames);
+    if (ghosts.count == ghosts.capacity || !recorder.frames) return;
+    i16 *trace = malloc(recorder.frames * sizeof(i16));
+    if (!trace) return;
+    memcpy(trace, recorder.trace, recorder.frames * sizeof(i16));
+    ghosts.runs[ghosts.count].trace = trace;
+    ghosts.runs[ghosts.count].frames = recorder.frames;
+    ghosts.count++;
+}
+
+static void load_ghosts(u32 seed)
+{
+    char path[256];
+    ghost_entry *index = 0;
+    i32 entries = 0;
+    ghosts.page = sysconf(_SC_PAGESIZE);
+    ghost_path(path, sizeof(path), seed, ".idx");
+    FILE *f = fopen(path, "rb");
+    if (f) {
+        fseek(f, 0, SEEK_END);
+        entries = ftell(f) / sizeof(ghost_entry);
+        fseek(f, 0, SEEK_SET);
+        index = malloc(entries * sizeof(ghost_entry));
+        entries = index ? fread(index, sizeof(ghost_entry), entries, f) : 0;
+        fclose(f);
+    }
+
+    ghosts.capacity = entries + GHOST_SESSION;
+    ghosts.runs = malloc(ghosts.capacity * sizeof(*ghosts.runs));
+    ghosts.vertices = malloc(4 * ghosts.capacity * sizeof(SDL_Vertex));
+    ghosts.indices = malloc(6 * ghosts.capacity * sizeof(i32));
+    for (i32 i = 0; i < ghosts.capacity; ++i) {
+        static const i32 quad[6] = {0, 1, 2, 2, 3, 0};
+        for (i32 j = 0; j < 6; ++j) ghosts.indices[6 * i + j] = 4 * i + quad[j];
+        for (i32 j = 0; j < 4; ++j) {
+            ghosts.vertices[4 * i + j].color = (SDL_Color){0xff, 0xff, 0xff, GHOST_ALPHA};
+            ghosts.vertices[4 * i + j].tex_coord = (SDL_FPoint){ j == 1 || j == 2, j >= 2 };
+        }
+    }
+    if (!entries) goto done;
+
+    ghost_path(path, sizeof(path), seed, "");
+    i32 fd = open(path, O_RDONLY);
+    if (fd < 0) goto done;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        ghosts.size = st.st_size;
+        ghosts.map = mmap(0, ghosts.size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ghosts.map == MAP_FAILED) ghosts.map = 0;
+    }
+    close(fd);
+    if (!ghosts.map) goto done;
+
+    for (i32 i = 0; i < entries; ++i) {
+        ghost_entry e = index[i];
+        if (e.magic != GHOST_MAGIC || e.offset % sizeof(i16) || e.offset > ghosts.size || e.frames > (ghosts.size - e.offset) / sizeof(i16)) {
+            fprintf(stderr, "%s: corrupt index entry %d, skipping it\n", path, i);
+            continue;
+        }
+        if (!e.frames) continue;
+        ghosts.runs[ghosts.count].trace = (const i16 *)(ghosts.map + e.offset);
+        ghosts.runs[ghosts.count].frames = e.frames;
+        // only what this ghost draws before prefetch_ghosts first gets to it
+        u32 first = ghosts.count % GHOST_PREFETCH ? ghosts.count % GHOST_PREFETCH : GHOST_PREFETCH;
+        ghosts.count++;
+        prefetch_trace(ghosts.count - 1, 0, first + GHOST_LEAD);
+    }
+done:
+    free(index);
+    ghosts.loaded = ghosts.count;
+    printf("course %u: racing %d ghosts\n", seed, ghosts.count);
+}
+
+static void unload_ghosts(void)
+{
+    for (i32 i = ghosts.loaded; i < ghosts.count; ++i) free((void *)ghosts.runs[i].trace);
+    if (ghosts.map) munmap(ghosts.map, ghosts.size);
+    free(ghosts.runs);
+    free(ghosts.vertices);
+    free(ghosts.indices);
+    memset(&ghosts, 0, sizeof(ghosts));
+}
+
+// quads of all ghosts still alive at s->frame, returns how many were written
+static i32 fill_ghost_vertices(const snapshot *s)
+{
+    if (!s->frame) return 0;
+    f32 hw = s->bird.w / 2.0f, hh = s->bird.h / 2.0f;
+    f32 cx = s->bird.x + hw;
+    i32 n = 0;
+    for (i32 i = 0; i < s->ghost_count; ++i) {
+        if (s->frame > ghosts.runs[i].frames) continue;
+        const i16 *y = ghosts.runs[i].trace + s->frame - 1;
+        f32 velocity = s->frame > 1 ? y[0] - y[-1] : 0;
+        f32 angle = 1.5f * velocity * (f32)M_PI / 180.0f;
+        f32 c = cosf(angle), sn = sinf(angle), cy = y[0] + hh;
+        SDL_Vertex *v = ghosts.vertices + 4 * n++;
+        for (i32 j = 0; j < 4; ++j) {
+            f32 dx = v[j].tex_coord.x ? hw : -hw, dy = v[j].tex_coord.y ? hh : -hh;
+            v[j].position = (SDL_FPoint){ cx + c * dx - sn * dy, cy + sn * dx + c * dy };
+        }
+    }
+    return n;
+}
+
+// all ghosts in a single textured draw call
+static void draw_ghosts(const snapshot *s)
+{
+    i32 n = fill_ghost_vertices(s);
+    if (n) SDL_RenderGeometry(game.renderer, sprites[SPRITE_BIRD].texture, ghosts.vertices, 4 * n, ghosts.indices, 6 * n);
+}
+
+/*** BENCHMARK *********************************/
+/*
+ * Frozen copies of the hot kernels, taken from the game as it shipped. Do not
+ * touch them: any faster version of AABBcollide, set_pipe or integrate_bird
+ * must agree with these on every state run_bench throws at it.
+ */
+static b32 ref_AABBcollide(SDL_Rect a, SDL_Rect b) 
+{
+    if (a.x + a.w < b.x || a.x > b.x + b.w) return 0;
+    if (a.y + a.h < b.y || a.y > b.y + b.h) return 0;
+    return 1;
+}
+
+static void ref_set_pipe(SDL_Rect *top, SDL_Rect *bottom, f32 pos_x, f32 pos_y)
+{
+    *top = (SDL_Rect){
+        pos_x - sprites[SPRITE_PIPE].width / 2.0f,
+        pos_y - sprites[SPRITE_PIPE].height - 0.5 * spawner.gap,
+        sprites[SPRITE_PIPE].width,
+        sprites[SPRITE_PIPE].height
+    };
+    *bottom = (SDL_Rect){
+        pos_x - sprites[SPRITE_PIPE].width / 2.0f, 
+        pos_y + 0.5 * spawner.gap,
+        sprites[SPRITE_PIPE].width,
+        sprites[SPRITE_PIPE].height
+    };
+}
+
+static void ref_integrate_bird(SDL_Rect *aabb, f32 *velocity, b32 *jumped, b32 space)
+{
+    if (space && !*jumped) {
+        *velocity = -JUMP_VELOCITY;
+        *jumped = 1;
+    } else if (!space) {
+        *jumped = 0;
+    }
+
+    *velocity = fmin(*velocity + GRAVITY, TERMINAL_SPEED);
+    aabb->y += *velocity;
+}
+
+#define BENCH_SEED      0x2545f4914f6cdd1dull
+#define BENCH_WARMUP    3
+#define BENCH_MIN_NS    1e6  // every timed run lasts at least this long, so the clock resolution is noise
+#define BENCH_SAMPLES   64   // sets of states the spread is reported across
+#define BENCH_STATES    4096
+#define BENCH_SET       (BENCH_STATES / BENCH_SAMPLES)
+#define DIFF_ITERATIONS (1 << 22)
+#define BENCH_GHOSTS    10000
+#define BENCH_GHOST_RUN (60 * 60)   // frames in every synthetic run
+#define BENCH_GHOST_SEED 0xb0a710ad
+#define BENCH_GHOST_DIR  "/var/tmp/flappy-ghosts-XXXXXX"
+#define BENCH_CLOBBER() __asm__ volatile("" ::: "memory") // keeps repetitions from being folded together
+
+static u64 rng_state = BENCH_SEED;
+static volatile u32 bench_sink;
+static SDL_Rect bench_rects[BENCH_STATES];
+static f32 bench_floats[BENCH_STATES];
+
+static u32 rng(void) // xorshift64*
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+static f64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// a rect somewhere in or around the screen, about the size of a bird or a pipe
+static SDL_Rect random_rect(void)
+{
+    return (SDL_Rect){ 
+        (i32)(rng() % (2 * SCREEN_WIDTH)) - SCREEN_WIDTH / 2, 
+        (i32)(rng() % (2 * SCREEN_HEIGHT)) - SCREEN_HEIGHT / 2,
+        rng() % 200, rng() % 600 
+    };
+}
+
+static f32 random_float(f32 lo, f32 hi)
+{
+    return lo + (hi - lo) * (rng() / 4294967296.0f);
+}
+
+static void run_AABBcollide(i32 set, u32 reps)
+{
+    u32 sink = 0;
+    for (u32 r = 0; r < reps; ++r) {
+        for (i32 i = set * BENCH_SET; i < (set + 1) * BENCH_SET; ++i) sink += AABBcollide(bench_rects[i], bench_rects[(i + 1) % BENCH_STATES]);
+        BENCH_CLOBBER();
+    }
+    bench_sink = sink;
+}
+
+static void run_set_pipe(i32 set, u32 reps)
+{
+    u32 sink = 0;
+    for (u32 r = 0; r < reps; ++r) {
+        for (i32 i = set * BENCH_SET; i < (set + 1) * BENCH_SET; ++i) {
+            set_pipe(i % 5, bench_rects[i].x, bench_rects[i].y);
+            sink += pipes[i % 5].bottom.y;
+        }
+        BENCH_CLOBBER();
+    }
+    bench_sink = sink;
+}
+
+static void run_integrate_bird(i32 set, u32 reps)
+{
+    for (u32 r = 0; r < reps; ++r) {
+        for (i32 i = set * BENCH_SET; i < (set + 1) * BENCH_SET; ++i) {
+            bird.aabb.y = bench_rects[i].y;
+            bird.velocity = bench_floats[i];
+            integrate_bird(i & 8);
+        }
+        BENCH_CLOBBER();
+    }
+    bench_sink = bird.aabb.y;
+}
+
+static snapshot bench_ghost_frame;
+
+static void run_ghost_frame(i32 sample, u32 reps)
+{
+    bench_ghost_frame.frame = 1 + sample * (BENCH_GHOST_RUN / BENCH_SAMPLES);
+    u32 sink = 0;
+    for (u32 r = 0; r < reps; ++r) {
+        sink += fill_ghost_vertices(&bench_ghost_frame);
+        BENCH_CLOBBER();
+    }
+    bench_sink = sink;
+}
+
+// drops a ghost file from the page cache, so the next read has to go to the disk
+static void evict(const char *path)
+{
+    i32 fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// megabytes of the mapped traces in the page cache
+static f64 ghosts_resident(void)
+{
+    size_t pages = (ghosts.size + ghosts.page - 1) / ghosts.page, resident = 0;
+    u8 *vec = malloc(pages);
+    if (!vec || mincore(ghosts.map, ghosts.size, vec)) { free(vec); return -1; }
+    for (size_t i = 0; i < pages; ++i) resident += vec[i] & 1;
+    free(vec);
+    return resident * ghosts.page / (f64)(1 << 20);
+}
+
+static i32 compare_f64(const void *a, const void *b)
+{
+    f64 x = *(const f64 *)a, y = *(const f64 *)b;
+    return (x > y) - (x < y);
+}
+
+static f64 time_run(void (*run)(i32, u32), i32 sample, u32 reps)
+{
+    f64 start = now_ns();
+    run(sample, reps);
+    return now_ns() - start;
+}
+
+/*
+ * Times `run` on every sample, less `baseline` when given, and prints the
+ * median ns/op together with the fastest and slowest sample.
+ */
+static f64 bench(const char *name, void (*run)(i32, u32), void (*baseline)(i32, u32), u32 ops, const char *samples)
+{
+    static f64 ns[BENCH_SAMPLES];
+    u32 reps = 1;
+    while (time_run(run, 0, reps) < BENCH_MIN_NS) reps *= 2;
+    for (i32 i = 0; i < BENCH_WARMUP; ++i) run(i, reps);
+    for (i32 i = 0; i < BENCH_SAMPLES; ++i) {
+        f64 t = time_run(run, i, reps);
+        if (baseline) t -= time_run(baseline, i, reps);
+        ns[i] = t / ((f64)reps * ops);
+    }
+    qsort(ns, BENCH_SAMPLES, sizeof(f64), compare_f64);
+    f64 median = (ns[BENCH_SAMPLES / 2 - 1] + ns[BENCH_SAMPLES / 2]) / 2;
+    printf("%-20s %8.2f ns/op  (min %.2f, max %.2f across %d %s)\n", name, median, ns[0], ns[BENCH_SAMPLES - 1], BENCH_SAMPLES, samples);
+    return median;
+}
+
+static b32 differential(void)
+{
+    for (u32 n = 0; n < DIFF_ITERATIONS; ++n) {
+        SDL_Rect a = random_rect(), b = random_rect();
+        if (AABBcollide(a, b) != ref_AABBcollide(a, b)) {
+            fprintf(stderr, "AABBcollide: mismatch at iteration %u ({%d %d %d %d} vs {%d %d %d %d})\n", n, a.x, a.y, a.w, a.h, b.x, b.y, b.w, b.h);
+            return 0;
+        }
+
+        sprites[SPRITE_PIPE].width = 1 + rng() % 200;
+        sprites[SPRITE_PIPE].height = 1 + rng() % 800;
+        spawner.gap = random_float(0, 400);
+        f32 pos_x = random_float(-SCREEN_WIDTH, 2 * SCREEN_WIDTH), pos_y = random_float(0, SCREEN_HEIGHT);
+        SDL_Rect top, bottom;
+        set_pipe(0, pos_x, pos_y);
+        ref_set_pipe(&top, &bottom, pos_x, pos_y);
+        if (memcmp(&top, &pipes[0].top, sizeof(top)) || memcmp(&bottom, &pipes[0].bottom, sizeof(bottom))) {
+            fprintf(stderr, "set_pipe: mismatch at iteration %u (pos %f,%f gap %f)\n", n, pos_x, pos_y, spawner.gap);
+            return 0;
+        }
+
+        SDL_Rect aabb = bird.aabb = random_rect();
+        f32 velocity = bird.velocity = random_float(-2 * JUMP_VELOCITY, 2 * TERMINAL_SPEED);
+        b32 jumped = bird.jumped = rng() & 1;
+        b32 space = rng() & 1;
+        integrate_bird(space);
+        ref_integrate_bird(&aabb, &velocity, &jumped, space);
+        if (memcmp(&aabb, &bird.aabb, sizeof(aabb)) || velocity != bird.velocity || jumped != bird.jumped) {
+            fprintf(stderr, "integrate_bird: mismatch at iteration %u\n", n);
+            return 0;
+        }
+    }
+    printf("differential: %d states agree with the reference kernels\n", DIFF_ITERATIONS);
+    return 1;
+}
+
+static i32 run_bench(void)
+{
+    printf("seed: %#llx\n", (unsigned long long)BENCH_SEED);
+    if (!differential()) return 1;
+    for (i32 i = 0; i < BENCH_STATES; ++i) {
+        bench_rects[i] = random_rect();
+        bench_floats[i] = random_float(-2 * JUMP_VELOCITY, 2 * TERMINAL_SPEED);
+    }
+    bench("AABBcollide", run_AABBcollide, 0, BENCH_SET, "state sets");
+    bench("set_pipe", run_set_pipe, 0, BENCH_SET, "state sets");
+    bench("integrate_bird", run_integrate_bird, 0, BENCH_SET, "state sets");
+
+    // a leaderboard course: BENCH_GHOSTS random-walk runs in a scratch directory, evicted, then mapped and replayed cold
+    static i16 trace[BENCH_GHOST_RUN];
+    char dir[] = BENCH_GHOST_DIR, path[256], index[256];
+    if (!mkdtemp(dir)) {
+        perror(dir);
+        return 1;
+    }
+    ghost_dir = dir;
+    ghost_path(path, sizeof(path), BENCH_GHOST_SEED, "");
+    ghost_path(index, sizeof(index), BENCH_GHOST_SEED, ".idx");
+    for (i32 g = 0; g < BENCH_GHOSTS; ++g) {
+        f32 y = random_float(200, SCREEN_HEIGHT - 200), velocity = 0;
+        for (i32 i = 0; i < BENCH_GHOST_RUN; ++i) {
+            velocity = rng() % 20 == 0 ? -JUMP_VELOCITY : fmin(velocity + GRAVITY, TERMINAL_SPEED);
+            y = fmin(SCREEN_HEIGHT - 50, fmax(0, y + velocity));
+            trace[i] = y;
+        }
+        append_run(BENCH_GHOST_SEED, trace, BENCH_GHOST_RUN);
+    }
+    evict(path);
+    evict(index);
+
+    f64 start = now_ns();
+    load_ghosts(BENCH_GHOST_SEED);
+    printf("%-20s %8.1f ms        (%.1f of %.1f MB traces resident)\n", "ghost load", (now_ns() - start) / 1e6, ghosts_resident(), ghosts.size / (f64)(1 << 20));
+    bench_ghost_frame.bird = (SDL_Rect){ SCREEN_WIDTH / 3 - 30, 0, 60, 42 };
+    bench_ghost_frame.ghost_count = ghosts.count;
+
+    // one pass through the whole run as the game would do it, page crossings and read-ahead included
+    f64 worst = 0, first_second = 0;
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    start = now_ns();
+    for (u32 frame = 1; frame <= BENCH_GHOST_RUN; ++frame) {
+        f64 t = now_ns();
+        prefetch_ghosts(frame);
+        bench_ghost_frame.frame = frame;
+        bench_sink = fill_ghost_vertices(&bench_ghost_frame);
+        worst = fmax(worst, now_ns() - t);
+        if (frame == 60) first_second = ghosts_resident();
+    }
+    f64 elapsed = now_ns() - start, last = ghosts_resident();
+    getrusage(RUSAGE_SELF, &after);
+    printf("%-20s %8.1f us/frame  (worst %.1f over %d frames of %d ghosts, %ld waits on the disk)\n", "ghost replay",
+           elapsed / BENCH_GHOST_RUN / 1000, worst / 1000, BENCH_GHOST_RUN, ghosts.count, after.ru_majflt - before.ru_majflt);
+    printf("%-20s %8.1f MB after 1 s, %.1f MB after the whole run\n", "ghost resident", first_second, last);
+    bench("ghost vertices", run_ghost_frame, 0, ghosts.count, "frames");
+    unload_ghosts();
+    unlink(path);
+    unlink(index);
+    rmdir(dir);
+    ghost_dir = "ghosts";
+    return 0;
+}
+
+static void update(void)
+{
+    b32 clicked = atomic_exchange(&game.mouse_clicked, 0);
+    scroll_background();
+    switch (game.state) {
+        case GAME_STATE_MENU: 
+            update_menu(clicked); 
+            bird.aabb.y = SCREEN_HEIGHT/2 + 30.0f * sinf(SDL_GetTicks() / 500.0f);
+            break;
+        case GAME_STATE_PLAYING: 
+            update_playing(); 
+            if (recorder.frames < MAX_RUN_FRAMES) recorder.trace[recorder.frames++] = bird.aabb.y;
+            prefetch_ghosts(recorder.frames);
+            if (game.state == GAME_STATE_GAME_OVER) save_run();
+            break;
+        case GAME_STATE_GAME_OVER: 
+            if (game.score > game.highscore) {
+                game.highscore = game.score;
+                game.savefile = fopen("savefile", "wb");
+                fwrite(&game.highscore, sizeof(game.highscore), 1, game.savefile);
+            }
+            update_menu(clicked); 
+            break;
+    }
+}
+
+static void take_snapshot(snapshot *s)
+{
+    s->state = game.state;
+    s->sky[0] = background.r1;
+    s->sky[1] = background.r2;
+    s->bird = bird.aabb;
+    s->bird_velocity = bird.velocity;
+    for (i32 i = 0; i < 5; ++i) {
+        s->pipe_top[i] = pipes[i].top;
+        s->pipe_bottom[i] = pipes[i].bottom;
+        s->pipe_visible[i] = spawner.visible[i];
+    }
+    s->score = game.score;
+    s->highscore = game.highscore;
+    s->frame = recorder.frames;
+    s->ghost_count = ghosts.count;
+}
+
+static void draw(const snapshot *s)
 {
+    byte textbuffer[10]; 
+    SDL_RenderClear(game.renderer);
+    draw_sprite(SPRITE_SKY, s->sky[0], 0, 0);
+    draw_sprite(SPRITE_SKY, s->sky[1], 0, 0);
+
+    switch (s->state) {
+        case GAME_STATE_MENU: 
+            draw_sprite(SPRITE_BIRD, s->bird, 1.5 * s->bird_velocity, 0);
+            draw_sprite(SPRITE_PLAY, button_box, 0, 0);
+            break;
+        case GAME_STATE_PLAYING: 
+            draw_pipes(s);
+            draw_ghosts(s);
+            draw_sprite(SPRITE_BIRD, s->bird, 1.5 * s->bird_velocity, 0);
+            break;
+        case GAME_STATE_GAME_OVER: 
+            draw_pipes(s);
+            draw_ghosts(s);
+            draw_sprite(SPRITE_BIRD, s->bird, 1.5 * s->bird_velocity, 0);
+            draw_sprite(SPRITE_GAMEOVER, gameover_box, 0, 0);
+            draw_sprite(SPRITE_RESTART, button_box, 0, 0);
+            snprintf(textbuffer, 10, "%d", s->score);
+            draw_text(textbuffer, gameover_box.x + gameover_box.w - 80, gameover_box.y + 200 + 3, 1);
+            snprintf(textbuffer, 10, "%d", s->highscore);
+            draw_text(textbuffer, gameover_box.x + gameover_box.w - 80, gameover_box.y + 250 - 3, 1);
+            break;
+    }
+
+    snprintf(textbuffer, 10, "%d", s->score);
+    draw_text(textbuffer, SCREEN_WIDTH / 2, 100, 2);
+}
+
+static void tb_publish(void)
+{
+    tb.back = atomic_exchange(&tb.middle, tb.back | TB_FRESH) & ~TB_FRESH;
+}
+
+static const snapshot *tb_acquire(void)
+{
+    if (atomic_load(&tb.middle) & TB_FRESH)
+        tb.front = atomic_exchange(&tb.middle, tb.front) & ~TB_FRESH;
+    return &tb.slots[tb.front];
+}
+
+static i32 simulate(void *data)
+{
+    (void)data;
+    while (atomic_load(&running)) {
+        u32 start = SDL_GetTicks();
+        update();
+        take_snapshot(&tb.slots[tb.back]);
+        tb_publish();
+        if (options.sim_load) SDL_Delay(options.sim_load);
+        atomic_fetch_add(&sim_steps, 1);
+        u32 elapsed = SDL_GetTicks() - start;
+        f32 sleep_ms = (MS_PER_FRAME) - elapsed;
+        if (sleep_ms > 0) usleep(sleep_ms * 1000);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    for (i32 opt; (opt = getopt(argc, argv, "btps:r:c:")) != -1;) {
+        switch (opt) {
+            case 'b': return run_bench();
+            case 't': options.threaded = 1;                   break;
+            case 'p': options.print_rates = 1;                break;
+            case 's': options.sim_load = atoi(optarg);        break;
+            case 'r': options.render_load = atoi(optarg);     break;
+            case 'c': options.fixed_course = 1; options.course_seed = strtoul(optarg, 0, 0); break;
+            default:
+                fprintf(stderr, "usage: %s [-b] [-t] [-p] [-s sim_load_ms] [-r render_load_ms] [-c course_seed]\n", argv[0]);
+                return 1;
+        }
+    }
+
     if (!initialize()) {
         printf("error: game couldn't start\n");
         return 1;
     }
+    spawner.seed = options.fixed_course ? options.course_seed : (u32)rand(); // every restart replays this course
+    load_ghosts(spawner.seed);
+
+    snapshot local;
+    SDL_Thread *sim_thread = 0;
+    if (options.threaded) {
+        take_snapshot(&tb.slots[tb.front]);
+        if (!(sim_thread = SDL_CreateThread(simulate, "simulation", 0))) goto done;
+    }
 
     SDL_Event e; 
     b32 quit = 0; 
-    byte textbuffer[10]; 
+    u32 frames = 0, last_report = SDL_GetTicks();
     while (!quit) {
         u32 start = SDL_GetTicks();
-        game.mouse_clicked = 0;
         while (SDL_PollEvent(&e)) {
             switch(e.type) {
                 case SDL_QUIT:            quit = 1; puts("quitting...");                        break;
@@ -344,46 +1029,33 @@ int main(void)
 
         if (game.keyboard[SDL_SCANCODE_ESCAPE]) break;
 
-        SDL_RenderClear(game.renderer);
-        do_background();
-
-        switch (game.state) {
-            case GAME_STATE_MENU: 
-                update_menu(); 
-                bird.aabb.y = SCREEN_HEIGHT/2 + 30.0f * sinf(SDL_GetTicks() / 500.0f);
-                draw_sprite(SPRITE_BIRD, bird.aabb, 1.5 * bird.velocity, 0);
-                draw_sprite(SPRITE_PLAY, button_box, 0, 0);
-                break;
-            case GAME_STATE_PLAYING: 
-                update_playing(); 
-                draw_pipes();
-                draw_sprite(SPRITE_BIRD, bird.aabb, 1.5 * bird.velocity, 0);
-                break;
-            case GAME_STATE_GAME_OVER: 
-                if (game.score > game.highscore) {
-                    game.highscore = game.score;
-                    game.savefile = fopen("savefile", "wb");
-                    fwrite(&game.highscore, sizeof(game.highscore), 1, game.savefile);
-                }
-
-                update_menu(); 
-                draw_pipes();
-                draw_sprite(SPRITE_BIRD, bird.aabb, 1.5 * bird.velocity, 0);
-                draw_sprite(SPRITE_GAMEOVER, gameover_box, 0, 0);
-                draw_sprite(SPRITE_RESTART, button_box, 0, 0);
-                snprintf(textbuffer, 10, "%d", game.score);
-                draw_text(textbuffer, gameover_box.x + gameover_box.w - 80, gameover_box.y + 200 + 3, 1);
-                snprintf(textbuffer, 10, "%d", game.highscore);
-                draw_text(textbuffer, gameover_box.x + gameover_box.w - 80, gameover_box.y + 250 - 3, 1);
-                break;
+        if (options.threaded) {
+            draw(tb_acquire());
+        } else {
+            update();
+            if (options.sim_load) SDL_Delay(options.sim_load);
+            take_snapshot(&local);
+            draw(&local);
+            atomic_fetch_add(&sim_steps, 1);
         }
-
-        snprintf(textbuffer, 10, "%d", game.score);
-        draw_text(textbuffer, SCREEN_WIDTH / 2, 100, 2);
+        if (options.render_load) SDL_Delay(options.render_load);
         SDL_RenderPresent(game.renderer);
+        ++frames;
+
+        if (options.print_rates && start - last_report >= 1000) {
+            f32 seconds = (start - last_report) / 1000.0f;
+            printf("sim: %5.1f Hz  render: %5.1f Hz\n", atomic_exchange(&sim_steps, 0) / seconds, frames / seconds);
+            frames = 0;
+            last_report = start;
+        }
         u32 elapsed = SDL_GetTicks() - start;
         f32 sleep_ms = (MS_PER_FRAME) - elapsed;
         if (sleep_ms > 0) usleep(sleep_ms * 1000);
     }
+
+    atomic_store(&running, 0);
+    if (sim_thread) SDL_WaitThread(sim_thread, 0);
+done:
+    unload_ghosts();
     return cleanup();
 }
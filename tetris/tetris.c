@@ -27,6 +27,7 @@
 
 #include <assert.h>
 #include <math.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -40,7 +41,9 @@
 typedef int8_t i8;
 typedef int32_t i32;
 typedef uint32_t u32;
+typedef uint64_t u64;
 typedef float f32;
+typedef double f64;
 typedef int32_t b32;
 
 #define MS_PER_FRAME 16.666667
@@ -70,8 +73,14 @@ typedef struct {
 } tetromino;
 
 
+/* state handed from the simulation to the renderer */
+typedef struct {
+    tetromino t;
+    u32 grid[NUMCOLS * NUMROWS];
+} snapshot;
+
 /* STATIC DATA *********************************/
-b32 keyboard[SDL_NUM_SCANCODES] = {0};
+_Atomic b32 keyboard[SDL_NUM_SCANCODES] = {0}; // written by the event loop, read by the simulation
 u32 grid[NUMCOLS * NUMROWS]     = {0}; // colors stored as 0xrrggbb. 0 means empty cell.
 SDL_Rect grid_rects[NUMCOLS * NUMROWS] = {0};
 #define OFFTBL(x, y) ((x) + (y) * NUMCOLS)
@@ -106,6 +115,28 @@ struct {
     SDL_Rect cols[NUMCOLS + 1];
 } gridlines;
 
+static struct {
+    b32 threaded;       // -t: simulate on its own thread
+    b32 print_rates;    // -p: print simulation and render rates every second
+    u32 sim_load;       // -s MS: artificial delay added to every simulation step
+    u32 render_load;    // -r MS: artificial delay added to every rendered frame
+} options = {0};
+
+/*
+ * Triple buffer between the simulation thread (producer) and the render
+ * thread (consumer). Each side owns one slot, the third one is parked in
+ * `middle` with TB_FRESH set when it holds an unread snapshot. Both publish
+ * and acquire are a single atomic exchange, so neither side ever blocks.
+ */
+#define TB_FRESH 4
+static struct {
+    snapshot slots[3];
+    _Atomic i32 middle;
+    i32 back, front;
+} tb = { .middle = 1, .back = 0, .front = 2 };
+static atomic_int running = 1;
+static atomic_int sim_steps = 0;
+
 /*** CODE **************************************/
 static void init_cell_rects(void) 
 {
@@ -157,6 +188,19 @@ static tetromino trotate(tetromino t, b32 clockwise)
     return t;
 }
 
+static void compact_rows(void)
+{
+    i32 target = NUMROWS - 1, j;
+    for (i32 cursor = NUMROWS - 1; cursor >= 0; --cursor) {
+        for (j = 0; j < NUMCOLS; ++j) if (!grid[cursor*NUMCOLS + j]) break;
+        if (j != NUMCOLS) {
+            if (target != cursor) memcpy(grid + target*NUMCOLS, grid + cursor*NUMCOLS, NUMCOLS*sizeof(u32));
+            --target;
+        }
+    }
+    while (target >= 0) memset(grid + target-- * NUMCOLS, 0, NUMCOLS * sizeof(u32));
+}
+
 static tetromino tnext(void) 
 {
     static u32 colors[] = {0x00ffff, 0x00ff00, 0xff0000, 0xffff00, 0x0000ff, 0xff00ff, 0xffffff};
@@ -252,21 +296,288 @@ static tetromino update_game(tetromino t, f32 current_time)
         }
     }
 
+    compact_rows();
+    return t;
+}
+
+/*** BENCHMARK *********************************/
+/*
+ * Frozen copies of the hot kernels, taken from the game as it shipped. Do not
+ * touch them: any faster version of is_position_valid, trotate or
+ * compact_rows must agree with these on every state run_bench throws at it.
+ */
+static b32 ref_is_position_valid(tetromino t, const u32 *cells) 
+{
+    for (i32 i = 0; i < 4; i++) {
+        i32 block_x = t.grid_x + (t.off[i] % NUMCOLS);
+        i32 block_y = t.grid_y + (t.off[i] / NUMCOLS);
+        if (block_x < 0 || block_x >= NUMCOLS) return 0;
+        if (block_y >= NUMROWS) return 0;
+        if (block_y >= 0 && cells[block_y * NUMCOLS + block_x] != 0) return 0;
+    }
+    return 1;
+}
+
+static tetromino ref_trotate(tetromino t, b32 clockwise) 
+{
+    t.state = (t.state + 1 + (!clockwise * 2)) % 4;
+    t.off = offsets_table[t.type][t.state];
+    return t;
+}
+
+static void ref_compact_rows(u32 *cells)
+{
     i32 target = NUMROWS - 1, j;
     for (i32 cursor = NUMROWS - 1; cursor >= 0; --cursor) {
-        for (j = 0; j < NUMCOLS; ++j) if (!grid[cursor*NUMCOLS + j]) break;
+        for (j = 0; j < NUMCOLS; ++j) if (!cells[cursor*NUMCOLS + j]) break;
         if (j != NUMCOLS) {
-            if (target != cursor) memcpy(grid + target*NUMCOLS, grid + cursor*NUMCOLS, NUMCOLS*sizeof(u32));
+            if (target != cursor) memcpy(cells + target*NUMCOLS, cells + cursor*NUMCOLS, NUMCOLS*sizeof(u32));
             --target;
         }
     }
-    while (target >= 0) memset(grid + target-- * NUMCOLS, 0, NUMCOLS * sizeof(u32));
-  
+    while (target >= 0) memset(cells + target-- * NUMCOLS, 0, NUMCOLS * sizeof(u32));
+}
+
+#define BENCH_SEED      0x2545f4914f6cdd1dull
+#define BENCH_WARMUP    3
+#define BENCH_MIN_NS    1e6  // every timed run lasts at least this long, so the clock resolution is noise
+#define BENCH_SAMPLES   64   // boards (or sets of pieces) the spread is reported across
+#define BENCH_PIECES    4096
+#define DIFF_ITERATIONS (1 << 21)
+#define BENCH_CLOBBER() __asm__ volatile("" ::: "memory") // keeps repetitions from being folded together
+
+static u64 rng_state = BENCH_SEED;
+static volatile u32 bench_sink;
+static u32 bench_boards[BENCH_SAMPLES][NUMCOLS * NUMROWS];
+static tetromino bench_pieces[BENCH_PIECES];
+
+static u32 rng(void) // xorshift64*
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+static f64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// random stack of garbage, with a full row now and then so compaction has work to do
+static void random_board(u32 *cells)
+{
+    u32 density = rng() % 100;
+    for (i32 y = 0; y < NUMROWS; ++y) {
+        b32 full = rng() % 4 == 0;
+        for (i32 x = 0; x < NUMCOLS; ++x)
+            cells[y * NUMCOLS + x] = (full || rng() % 100 < density) ? (rng() & 0xffffff) | 1 : 0;
+    }
+}
+
+// any type and rotation, placed anywhere from partly off the board to fully inside it
+static tetromino random_piece(void)
+{
+    tetromino t = {0};
+    t.type = rng() % 7;
+    t.state = rng() % 4;
+    t.off = offsets_table[t.type][t.state];
+    t.grid_x = (i32)(rng() % (NUMCOLS + 4)) - 3;
+    t.grid_y = (i32)(rng() % (NUMROWS + 3)) - 2;
+    return t;
+}
+
+static void run_is_position_valid(i32 board, u32 reps)
+{
+    u32 sink = 0;
+    memcpy(grid, bench_boards[board], sizeof(grid));
+    for (u32 r = 0; r < reps; ++r) {
+        for (i32 i = 0; i < BENCH_PIECES; ++i) sink += is_position_valid(bench_pieces[i]);
+        BENCH_CLOBBER();
+    }
+    bench_sink = sink;
+}
+
+static void run_trotate(i32 set, u32 reps)
+{
+    u32 sink = 0;
+    tetromino *pieces = bench_pieces + set * (BENCH_PIECES / BENCH_SAMPLES);
+    for (u32 r = 0; r < reps; ++r) {
+        for (i32 i = 0; i < BENCH_PIECES / BENCH_SAMPLES; ++i) sink += trotate(pieces[i], i & 1).state;
+        BENCH_CLOBBER();
+    }
+    bench_sink = sink;
+}
+
+static void run_compact_rows(i32 board, u32 reps)
+{
+    for (u32 r = 0; r < reps; ++r) {
+        memcpy(grid, bench_boards[board], sizeof(grid));
+        compact_rows();
+        BENCH_CLOBBER();
+    }
+    bench_sink = grid[NUMCOLS * NUMROWS - 1];
+}
+
+// the board reload run_compact_rows needs before every call, timed on its own and subtracted
+static void run_reload_board(i32 board, u32 reps)
+{
+    for (u32 r = 0; r < reps; ++r) {
+        memcpy(grid, bench_boards[board], sizeof(grid));
+        BENCH_CLOBBER();
+    }
+    bench_sink = grid[NUMCOLS * NUMROWS - 1];
+}
+
+static i32 compare_f64(const void *a, const void *b)
+{
+    f64 x = *(const f64 *)a, y = *(const f64 *)b;
+    return (x > y) - (x < y);
+}
+
+static f64 time_run(void (*run)(i32, u32), i32 sample, u32 reps)
+{
+    f64 start = now_ns();
+    run(sample, reps);
+    return now_ns() - start;
+}
+
+/*
+ * Times `run` on every sample, less `baseline` when given, and prints the
+ * median ns/op together with the fastest and slowest sample.
+ */
+static f64 bench(const char *name, void (*run)(i32, u32), void (*baseline)(i32, u32), u32 ops, const char *samples)
+{
+    static f64 ns[BENCH_SAMPLES];
+    u32 reps = 1;
+    while (time_run(run, 0, reps) < BENCH_MIN_NS) reps *= 2;
+    for (i32 i = 0; i < BENCH_WARMUP; ++i) run(i, reps);
+    for (i32 i = 0; i < BENCH_SAMPLES; ++i) {
+        f64 t = time_run(run, i, reps);
+        if (baseline) t -= time_run(baseline, i, reps);
+        ns[i] = t / ((f64)reps * ops);
+    }
+    qsort(ns, BENCH_SAMPLES, sizeof(f64), compare_f64);
+    f64 median = (ns[BENCH_SAMPLES / 2 - 1] + ns[BENCH_SAMPLES / 2]) / 2;
+    printf("%-20s %8.2f ns/op  (min %.2f, max %.2f across %d %s)\n", name, median, ns[0], ns[BENCH_SAMPLES - 1], BENCH_SAMPLES, samples);
+    return median;
+}
+
+static b32 differential(void)
+{
+    static u32 board[NUMCOLS * NUMROWS];
+    for (u32 n = 0; n < DIFF_ITERATIONS; ++n) {
+        random_board(grid);
+        memcpy(board, grid, sizeof(grid));
+        tetromino t = random_piece();
+        if (is_position_valid(t) != ref_is_position_valid(t, board)) {
+            fprintf(stderr, "is_position_valid: mismatch at iteration %u (type %d, state %d, at %d,%d)\n", n, t.type, t.state, t.grid_x, t.grid_y);
+            return 0;
+        }
+        b32 clockwise = rng() & 1;
+        tetromino a = trotate(t, clockwise), b = ref_trotate(t, clockwise);
+        if (a.state != b.state || a.off != b.off) {
+            fprintf(stderr, "trotate: mismatch at iteration %u (type %d, state %d, clockwise %d)\n", n, t.type, t.state, clockwise);
+            return 0;
+        }
+        compact_rows();
+        ref_compact_rows(board);
+        if (memcmp(grid, board, sizeof(grid))) {
+            fprintf(stderr, "compact_rows: mismatch at iteration %u\n", n);
+            return 0;
+        }
+    }
+    printf("differential: %d states agree with the reference kernels\n", DIFF_ITERATIONS);
+    return 1;
+}
+
+static i32 run_bench(void)
+{
+    printf("seed: %#llx\n", (unsigned long long)BENCH_SEED);
+    if (!differential()) return EXIT_FAILURE;
+    for (i32 b = 0; b < BENCH_SAMPLES; ++b) random_board(bench_boards[b]);
+    for (i32 i = 0; i < BENCH_PIECES; ++i) bench_pieces[i] = random_piece();
+    bench("is_position_valid", run_is_position_valid, 0, BENCH_PIECES, "boards");
+    bench("trotate", run_trotate, 0, BENCH_PIECES / BENCH_SAMPLES, "piece sets");
+    bench("compact_rows", run_compact_rows, run_reload_board, 1, "boards");
+    return EXIT_SUCCESS;
+}
+
+static tetromino step(tetromino t, f32 current_time)
+{
+    if (keyboard[SDL_SCANCODE_SPACE]) {
+        memset(grid, 0, NUMCOLS * NUMROWS * sizeof(u32));
+        game_started = 1;
+    }
+    if (game_started) t = update_game(t, current_time);
     return t;
 }
 
-i32 main(void)
+static void take_snapshot(snapshot *s, tetromino t)
+{
+    s->t = t;
+    memcpy(s->grid, grid, sizeof(grid));
+}
+
+static void draw(SDL_Renderer *renderer, const snapshot *s)
+{
+    SDL_SetRenderDrawColor(renderer, 0x2d, 0x15, 0x81, 0xff);
+    SDL_RenderClear(renderer);
+    tdraw(renderer, s->t);
+    for (i32 i = 0; i < NUMCOLS * NUMROWS; ++i) {
+        if (s->grid[i]) { 
+            SDL_SetRenderDrawColor(renderer, (s->grid[i]&0xff0000)>>16, (s->grid[i] & 0xff00) >> 8, (s->grid[i] & 0xff), 0xff);
+            SDL_RenderFillRect(renderer, &grid_rects[i]); 
+        }
+    }
+    draw_gridlines(renderer);
+}
+
+static void tb_publish(void)
+{
+    tb.back = atomic_exchange(&tb.middle, tb.back | TB_FRESH) & ~TB_FRESH;
+}
+
+static const snapshot *tb_acquire(void)
+{
+    if (atomic_load(&tb.middle) & TB_FRESH)
+        tb.front = atomic_exchange(&tb.middle, tb.front) & ~TB_FRESH;
+    return &tb.slots[tb.front];
+}
+
+static i32 simulate(void *data)
 {
+    tetromino t = *(tetromino *)data; // the piece main already put on screen
+    while (atomic_load(&running)) {
+        u32 frame_start = SDL_GetTicks();
+        t = step(t, frame_start / 1000.0f);
+        take_snapshot(&tb.slots[tb.back], t);
+        tb_publish();
+        if (options.sim_load) SDL_Delay(options.sim_load);
+        atomic_fetch_add(&sim_steps, 1);
+        u32 elapsed = SDL_GetTicks() - frame_start;
+        if (elapsed < MS_PER_FRAME) SDL_Delay(MS_PER_FRAME - elapsed);
+    }
+    return 0;
+}
+
+i32 main(i32 argc, char **argv)
+{
+    for (i32 opt; (opt = getopt(argc, argv, "btps:r:")) != -1;) {
+        switch (opt) {
+            case 'b': return run_bench();
+            case 't': options.threaded = 1;                   break;
+            case 'p': options.print_rates = 1;                break;
+            case 's': options.sim_load = atoi(optarg);        break;
+            case 'r': options.render_load = atoi(optarg);     break;
+            default:
+                fprintf(stderr, "usage: %s [-b] [-t] [-p] [-s sim_load_ms] [-r render_load_ms]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
     srand(time(NULL));
     if (SDL_Init(SDL_INIT_VIDEO) < 0) return EXIT_FAILURE;
     SDL_Window *window = SDL_CreateWindow("Tetris", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, SCREEN_WIDTH, SCREEN_HEIGHT, SDL_WINDOW_SHOWN);
@@ -278,8 +589,16 @@ i32 main(void)
     init_cell_rects();
 
     tetromino t = tnext();
+    snapshot local;
+    SDL_Thread *sim_thread = 0;
+    if (options.threaded) {
+        take_snapshot(&tb.slots[tb.front], t);
+        if (!(sim_thread = SDL_CreateThread(simulate, "simulation", &t))) goto all;
+    }
+
     b32 quit = 0;
     SDL_Event ev;
+    u32 frames = 0, last_report = SDL_GetTicks();
     //f32 dt = 0; /* delta time in seconds */
     //printf("(%f, %f) -> %d\n", t.aabb.x, t.aabb.y, t.pos);
     while (!quit) {
@@ -295,28 +614,32 @@ i32 main(void)
             }
         }
 
-        if (keyboard[SDL_SCANCODE_SPACE]) {
-            memset(grid, 0, NUMCOLS * NUMROWS * sizeof(u32));
-            game_started = 1;
-        }
         if (keyboard[SDL_SCANCODE_ESCAPE]) quit = 1;
-        if (game_started) t = update_game(t, current_time);
-        SDL_SetRenderDrawColor(renderer, 0x2d, 0x15, 0x81, 0xff);
-        SDL_RenderClear(renderer);
-        tdraw(renderer, t);
-        for (i32 i = 0; i < NUMCOLS * NUMROWS; ++i) {
-            if (grid[i]) { 
-                SDL_SetRenderDrawColor(renderer, (grid[i]&0xff0000)>>16, (grid[i] & 0xff00) >> 8, (grid[i] & 0xff), 0xff);
-                SDL_RenderFillRect(renderer, &grid_rects[i]); 
-            }
+        if (options.threaded) {
+            draw(renderer, tb_acquire());
+        } else {
+            t = step(t, current_time);
+            if (options.sim_load) SDL_Delay(options.sim_load);
+            take_snapshot(&local, t);
+            draw(renderer, &local);
+            atomic_fetch_add(&sim_steps, 1);
         }
-
-        draw_gridlines(renderer);
+        if (options.render_load) SDL_Delay(options.render_load);
         SDL_RenderPresent(renderer);
+        ++frames;
+
+        if (options.print_rates && frame_start - last_report >= 1000) {
+            f32 seconds = (frame_start - last_report) / 1000.0f;
+            printf("sim: %5.1f Hz  render: %5.1f Hz\n", atomic_exchange(&sim_steps, 0) / seconds, frames / seconds);
+            frames = 0;
+            last_report = frame_start;
+        }
         u32 elapsed = SDL_GetTicks() - frame_start;
         if (elapsed < MS_PER_FRAME) SDL_Delay(MS_PER_FRAME - elapsed);
     }
 
+    atomic_store(&running, 0);
+    if (sim_thread) SDL_WaitThread(sim_thread, 0);
 all:    if (renderer) SDL_DestroyRenderer(renderer);
 window: if (window)   SDL_DestroyWindow(window);
     SDL_Quit();